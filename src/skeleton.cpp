@@ -33,13 +33,27 @@
 
 #include <KPluginFactory>
 
+#include <QCryptographicHash>
+#include <QDebug>
+#include <QFile>
+#include <QGuiApplication>
+#include <QHash>
 #include <QPainter>
 #include <QPainterPath>
-#include <QPropertyAnimation>
+#include <QSaveFile>
+#include <QStandardPaths>
+#include <QThreadPool>
+#include <QtConcurrent/QtConcurrentRun>
 
 #include <QtWidgets/qdrawutil.h>
 #include <QBitmap>
 
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 K_PLUGIN_FACTORY_WITH_JSON(SkeletonDecorationFactory,
     "skeleton.json",
     registerPlugin<Skeleton::Decoration>();
@@ -49,9 +63,14 @@ K_PLUGIN_FACTORY_WITH_JSON(SkeletonDecorationFactory,
 namespace Skeleton
 {
 
-// window border sizes
-int side = 4;
-int bottom_ = 8;
+#ifdef KDE2_COUNT_INSTANCES
+QAtomicInt liveAssets;
+QAtomicInt liveButtons;
+#endif
+
+// window border sizes at the Normal border size
+int normalSide = 4;
+int normalBottom = 8;
 int top = 1;
 // length of left titlebar extension
 int leftFrameOffset = 26-5;
@@ -60,7 +79,7 @@ int sepRight = 1;
 // spacing above stipple start
 int stippleTop = 2;
 // grab handle width
-int grabWidth = 2*side+12+1;
+int grabWidth = 2*normalSide+12+1;
 
 static const unsigned char iconify_bits[] = {
   0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x78, 0x00, 0x78, 0x00, 0x78, 0x00,
@@ -146,6 +165,21 @@ static const unsigned char pinup_mask_bits[] = {
   0xff, 0x3f, 0xff, 0x3f, 0xff, 0x3f, 0xc0, 0x3f, 0xc0, 0x31, 0xc0, 0x20,
   0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
 
+// Convert X11 style bitmap data into an image, set bits painted in color
+static QImage monoImage(const uchar *bits, int w, int h, const QColor &color)
+{
+    const int bytesPerLine = (w + 7) / 8;
+    QImage image(w, h, QImage::Format_MonoLSB);
+    image.setColorCount(2);
+    image.setColor(0, qRgba(0, 0, 0, 0));
+    image.setColor(1, color.rgba());
+    for (int y = 0; y < h; ++y) {
+        uchar *line = image.scanLine(y);
+        for (int i = 0; i < bytesPerLine; ++i)
+            line[i] = bits[y * bytesPerLine + i];
+    }
+    return image;
+}
 void drawColorBitmaps(QPainter *p, const QPalette &pal, int x, int y, int w, int h,
                       const uchar *lightColor, const uchar *midColor, const uchar *blackColor)
 {
@@ -154,24 +188,20 @@ void drawColorBitmaps(QPainter *p, const QPalette &pal, int x, int y, int w, int
     QColor colors[]={pal.color(QPalette::Light), pal.color(QPalette::Mid), Qt::black};
 
     int i;
-    QSize s(w,h);
     for(i=0; i < 3; ++i){
-        QBitmap b = QBitmap::fromData(s, data[i], QImage::Format_MonoLSB );
-        b.setMask(b);
-        p->setPen(colors[i]);
-        p->drawPixmap(x, y, b);
+        p->drawImage(x, y, monoImage(data[i], w, h, colors[i]));
     }
 }
-static void gradientFill(QPixmap *pixmap, const QColor &color1, const QColor &color2)
+static void gradientFill(QImage *image, const QColor &color1, const QColor &color2)
 {
-    QPainter p(pixmap);
-    QLinearGradient gradient(0, 0, 0, pixmap->height());
+    QPainter p(image);
+    QLinearGradient gradient(0, 0, 0, image->height());
     gradient.setColorAt(0.0, color1);
     gradient.setColorAt(1.0, color2);
     QBrush brush(gradient);
-    p.fillRect(pixmap->rect(), brush);
+    p.fillRect(image->rect(), brush);
 }
-void drawButtonBackground(QPixmap *pix,
+void drawButtonBackground(QImage *pix,
         const QPalette &g, bool sunken)
 {
     QPainter p;
@@ -206,49 +236,541 @@ void drawButtonBackground(QPixmap *pix,
     p.drawLine(x2-2, 2, x2-2, y2-2);
     p.drawLine(2, x2-2, y2-2, x2-2);
 }
+// Glyph paths are shared by all buttons showing the same bitmap
+static const QPainterPath &glyphPath(const unsigned char *bitmap)
+{
+    static QHash<const unsigned char *, QPainterPath> cache;
+
+    QHash<const unsigned char *, QPainterPath>::iterator it = cache.find(bitmap);
+    if (it == cache.end()) {
+        QPainterPath path;
+        path.addRegion(QRegion( QBitmap::fromData(QSize( 10, 10 ), bitmap) ));
+        it = cache.insert(bitmap, path);
+    }
+    return it.value();
+}
 void DecorationButton::setBitmap(const unsigned char *bitmap)
 {
-    delete deco;
-    deco = 0;
+    deco = bitmap;
+}
+
+// Everything the pre-rendered assets depend on. Assets are rendered on the
+// thread pool, so only plain values may be captured here.
+struct AssetKey
+{
+    QRgb titleBar;
+    QRgb frame;
+    QRgb stipple;
+    int buttonSize;
+    int titleHeight;
+};
+
+static bool operator==(const AssetKey &a, const AssetKey &b)
+{
+    return a.titleBar == b.titleBar && a.frame == b.frame && a.stipple == b.stipple
+        && a.buttonSize == b.buttonSize && a.titleHeight == b.titleHeight;
+}
+
+static uint qHash(const AssetKey &key, uint seed = 0)
+{
+    uint h = seed;
+    h = 31 * h + key.titleBar;
+    h = 31 * h + key.frame;
+    h = 31 * h + key.stipple;
+    h = 31 * h + uint(key.buttonSize);
+    h = 31 * h + uint(key.titleHeight);
+    return h;
+}
+
+static QImage buttonImage(int size, const QPalette &g, bool sunken)
+{
+    QImage image(size, size, QImage::Format_ARGB32_Premultiplied);
+    drawButtonBackground(&image, g, sunken);
+    return image;
+}
+
+static QImage pinImage(const QPalette &g, const uchar *white, const uchar *gray,
+                       const uchar *dgray, const uchar *mask)
+{
+    QImage image(16, 16, QImage::Format_ARGB32_Premultiplied);
+    image.fill(Qt::transparent);
+
+    QPainter p(&image);
+    drawColorBitmaps(&p, g, 0, 0, 16, 16, white, gray, dgray);
+    p.setCompositionMode(QPainter::CompositionMode_DestinationIn);
+    p.drawImage(0, 0, monoImage(mask, 16, 16, Qt::black));
+    return image;
+}
+
+// Make the titlebar stipple
+static QImage stippleImage(const QColor &color, int height)
+{
+    QImage image(132, height, QImage::Format_ARGB32_Premultiplied);
+    image.fill(Qt::transparent);
+
+    QPainter p(&image);
+    int i, x, y;
+    for(i=0, y=2; i < height/4; ++i, y+=4)
+        for(x=1; x <= 132; x+=3)
+        {
+            p.setPen(color.light(150));
+            p.drawPoint(x, y);
+            p.setPen(color.dark(150));
+            p.drawPoint(x+1, y+1);
+        }
+    return image;
+}
+
+// Optional store of rendered assets shared between KWin instances, e.g. one
+// per session on multi-seat hosts. It is enabled by setting KDE2_SHARED_ASSETS
+// to a directory, or to 1 for $XDG_RUNTIME_DIR. Every asset is a file holding
+// a header and premultiplied ARGB pixels, written atomically by whichever
+// instance renders it first and mapped read-only by all others. Assets are
+// only shared between the instances of one user: a host-wide directory holds
+// a subdirectory per uid, and only files owned by the user or root are used.
+// Any failure falls back to rendering locally.
+enum AssetKind {
+    LeftBtnUpAsset,
+    LeftBtnDownAsset,
+    RightBtnUpAsset,
+    RightBtnDownAsset,
+    PinUpAsset,
+    PinDownAsset,
+    TitleAsset
+};
+
+struct SharedAssetHeader
+{
+    quint32 magic;
+    quint32 version;
+    quint32 width;
+    quint32 height;
+    quint32 bytesPerLine;
+    quint32 format;
+    // keeps the pixel data 16 byte aligned
+    quint32 reserved[2];
+};
+
+struct SharedAssetMapping
+{
+    void *address;
+    size_t length;
+};
+
+static const quint32 sharedAssetMagic = 0x4b444532; // "KDE2"
+// bump whenever the file layout or the rendering of any asset changes
+static const quint32 sharedAssetVersion = 1;
+// far more than the largest asset, guards against mapping or reading junk
+static const off_t maxSharedAssetSize = 64 * 1024 * 1024;
+
+// Any directory other than $XDG_RUNTIME_DIR is shared with other users, who
+// each get a subdirectory of their own
+static bool sharedAssetsHostWide()
+{
+    static const bool hostWide = qgetenv("KDE2_SHARED_ASSETS") != "1";
+    return hostWide;
+}
 
-    if (bitmap) {
-        deco = new QPainterPath;
-        deco->addRegion(QRegion( QBitmap::fromData(QSize( 10, 10 ), bitmap) ));
-//      deco->setMask( *deco );
+// Directories writable by others are only trusted when they are sticky, so
+// that nobody else can replace the files in them
+static bool trustedAssetDir(const QString &path)
+{
+    struct stat st;
+    if (lstat(QFile::encodeName(path).constData(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+        return false;
     }
+    if (st.st_mode & S_ISVTX) {
+        return true;
+    }
+    return !(st.st_mode & (S_IWGRP | S_IWOTH)) && (st.st_uid == getuid() || st.st_uid == 0);
 }
-void Decoration::createPixmaps()
+
+// Creates the directory if needed. The mode is set explicitly, it must not
+// depend on the umask.
+static bool makeSharedAssetDir(const QString &path, mode_t mode)
 {
-    if (pinUpPix)
-        delete pinUpPix;
-    if (pinDownPix)
-        delete pinDownPix;
+    const QByteArray encoded = QFile::encodeName(path);
+    if (mkdir(encoded.constData(), mode) == 0) {
+        chmod(encoded.constData(), mode);
+    } else if (errno != EEXIST) {
+        return false;
+    }
+    return trustedAssetDir(path);
+}
 
-    // Set the sticky pin pixmaps;
-    QPalette *g;
-    QPainter p;
+static QString sharedAssetDir()
+{
+    static const QString dir = []() -> QString {
+        const QByteArray env = qgetenv("KDE2_SHARED_ASSETS");
+        if (env.isEmpty() || env == "0") {
+            return QString();
+        }
+        const QString base = env == "1" ? QStandardPaths::writableLocation(QStandardPaths::RuntimeLocation) : QFile::decodeName(env);
+        if (base.isEmpty()) {
+            return QString();
+        }
+        QString path = base + QStringLiteral("/kde2-decoration-assets-%1").arg(sharedAssetVersion);
+        // a sticky directory like /tmp, in which every user owns one
+        // subdirectory, so that nobody else can write or replace their files
+        if (sharedAssetsHostWide()) {
+            if (!makeSharedAssetDir(path, 01777)) {
+                return QString();
+            }
+            path += QLatin1Char('/') + QString::number(getuid());
+        }
+        return makeSharedAssetDir(path, 0700) ? path : QString();
+    }();
+    return dir;
+}
+
+static QString sharedAssetPath(const QString &dir, const AssetKey &key, AssetKind kind)
+{
+    const quint32 fields[] = {
+        quint32(QSysInfo::ByteOrder), quint32(kind),
+        key.titleBar, key.frame, key.stipple,
+        quint32(key.buttonSize), quint32(key.titleHeight)
+    };
+    const QByteArray hash = QCryptographicHash::hash(QByteArray::fromRawData(reinterpret_cast<const char *>(fields), sizeof(fields)),
+                                                     QCryptographicHash::Sha1);
+    return dir + QLatin1Char('/') + QString::fromLatin1(hash.toHex());
+}
+
+static void unmapSharedAsset(void *info)
+{
+    SharedAssetMapping *mapping = static_cast<SharedAssetMapping *>(info);
+    munmap(mapping->address, mapping->length);
+    delete mapping;
+}
+
+static bool validSharedAsset(const SharedAssetHeader *header, size_t length)
+{
+    return header->magic == sharedAssetMagic && header->version == sharedAssetVersion
+        && header->format == quint32(QImage::Format_ARGB32_Premultiplied)
+        && header->bytesPerLine >= quint64(header->width) * 4
+        && length == sizeof(SharedAssetHeader) + size_t(header->bytesPerLine) * header->height;
+}
+
+// Files of other users are never used: their owner could truncate them under
+// a mapping, which kills the reader with SIGBUS, or plant arbitrary pixels.
+static QImage loadSharedAsset(const QString &path)
+{
+    const int fd = open(QFile::encodeName(path).constData(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (fd < 0) {
+        return QImage();
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || (st.st_uid != getuid() && st.st_uid != 0)
+        || st.st_size < off_t(sizeof(SharedAssetHeader)) || st.st_size > maxSharedAssetSize) {
+        close(fd);
+        return QImage();
+    }
+    const size_t length = st.st_size;
+
+    void *address = mmap(Q_NULLPTR, length, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (address == MAP_FAILED) {
+        return QImage();
+    }
+    const SharedAssetHeader *header = static_cast<const SharedAssetHeader *>(address);
+    if (!validSharedAsset(header, length)) {
+        munmap(address, length);
+        return QImage();
+    }
+
+    SharedAssetMapping *mapping = new SharedAssetMapping;
+    mapping->address = address;
+    mapping->length = length;
+    return QImage(static_cast<const uchar *>(address) + sizeof(SharedAssetHeader),
+                  header->width, header->height, header->bytesPerLine,
+                  QImage::Format_ARGB32_Premultiplied, unmapSharedAsset, mapping);
+}
+
+static void storeSharedAsset(const QString &path, const QImage &image)
+{
+    SharedAssetHeader header;
+    header.magic = sharedAssetMagic;
+    header.version = sharedAssetVersion;
+    header.width = image.width();
+    header.height = image.height();
+    header.bytesPerLine = image.bytesPerLine();
+    header.format = image.format();
+    header.reserved[0] = header.reserved[1] = 0;
+
+    // QSaveFile renames into place, so readers never see a partial file and
+    // concurrent writers simply replace each other's identical result
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly)) {
+        return;
+    }
+    fchmod(file.handle(), 0600);
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char *>(image.constBits()), qint64(image.bytesPerLine()) * image.height());
+    file.commit();
+}
+
+template<typename Render>
+static QImage sharedAsset(const AssetKey &key, AssetKind kind, Render render)
+{
+    const QString dir = sharedAssetDir();
+    if (dir.isEmpty()) {
+        return render();
+    }
+    const QString path = sharedAssetPath(dir, key, kind);
+    QImage image = loadSharedAsset(path);
+    if (image.isNull()) {
+        image = render().convertToFormat(QImage::Format_ARGB32_Premultiplied);
+        storeSharedAsset(path, image);
+    }
+    return image;
+}
+
+static AssetsPtr renderAssets(const AssetKey &key)
+{
+    Assets *assets = new Assets;
+    const QPalette titleBar(QColor::fromRgba(key.titleBar));
+    const QPalette frame(QColor::fromRgba(key.frame));
+
+    // Cache all possible button states
+    assets->leftBtnUp = sharedAsset(key, LeftBtnUpAsset, [&]() { return buttonImage(key.buttonSize, titleBar, false); });
+    assets->leftBtnDown = sharedAsset(key, LeftBtnDownAsset, [&]() { return buttonImage(key.buttonSize, titleBar, true); });
+    assets->rightBtnUp = sharedAsset(key, RightBtnUpAsset, [&]() { return buttonImage(key.buttonSize, frame, false); });
+    assets->rightBtnDown = sharedAsset(key, RightBtnDownAsset, [&]() { return buttonImage(key.buttonSize, frame, true); });
+
+    // Set the sticky pin pixmaps
+    assets->pinUp = sharedAsset(key, PinUpAsset, [&]() {
+        return pinImage(frame, pinup_white_bits, pinup_gray_bits, pinup_dgray_bits, pinup_mask_bits);
+    });
+    assets->pinDown = sharedAsset(key, PinDownAsset, [&]() {
+        return pinImage(frame, pindown_white_bits, pindown_gray_bits, pindown_dgray_bits, pindown_mask_bits);
+    });
+
+    assets->title = sharedAsset(key, TitleAsset, [&]() { return stippleImage(QColor::fromRgba(key.stipple), key.titleHeight); });
+
+    return AssetsPtr(assets);
+}
+
+// Assets are shared by all decorations using the same colors and font, so a
+// color scheme change renders each set only once for all windows. Finished
+// sets are only referenced weakly and go away with the last decoration using
+// them, so palette and font changes do not accumulate memory.
+static QHash<AssetKey, QFuture<AssetsPtr> > &renderingAssets()
+{
+    static QHash<AssetKey, QFuture<AssetsPtr> > rendering;
+    return rendering;
+}
+
+// Renders run on a pool owned by the plugin, so that waiting for it covers
+// everything pool threads run of this plugin, see waitForAssets()
+static QThreadPool &assetPool()
+{
+    static QThreadPool pool;
+    return pool;
+}
+
+static QFuture<AssetsPtr> assetsFor(const AssetKey &key)
+{
+    QHash<AssetKey, QFuture<AssetsPtr> > &rendering = renderingAssets();
+    static QHash<AssetKey, QWeakPointer<const Assets> > cache;
+
+    QHash<AssetKey, QFuture<AssetsPtr> >::iterator it = rendering.begin();
+    while (it != rendering.end()) {
+        if (it.value().isFinished()) {
+            cache.insert(it.key(), it.value().result());
+            it = rendering.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    QHash<AssetKey, QFuture<AssetsPtr> >::const_iterator running = rendering.constFind(key);
+    if (running != rendering.constEnd()) {
+        return running.value();
+    }
+
+    QHash<AssetKey, QWeakPointer<const Assets> >::iterator cached = cache.begin();
+    while (cached != cache.end()) {
+        const AssetsPtr assets = cached.value().toStrongRef();
+        if (!assets) {
+            cached = cache.erase(cached);
+        } else if (cached.key() == key) {
+            QFutureInterface<AssetsPtr> ready(QFutureInterfaceBase::Started);
+            ready.reportFinished(&assets);
+            return ready.future();
+        } else {
+            ++cached;
+        }
+    }
+
+    QFuture<AssetsPtr> future = QtConcurrent::run(&assetPool(), renderAssets, key);
+    rendering.insert(key, future);
+    return future;
+}
+
+// Pool threads run code of this plugin, so it must not be unloaded while any
+// of them is still rendering. A finished future is not enough, the task
+// still runs the end of its run() and its destructor after reporting the
+// result, so this waits for the pool itself to become idle. It is called
+// when the last decoration goes.
+void waitForAssets()
+{
+    assetPool().waitForDone();
+    renderingAssets().clear();
+}
 
-    // Active pins
-    g = new QPalette(client().data()->color(client().data()->isActive() ? KDecoration2::ColorGroup::Active : KDecoration2::ColorGroup::Inactive, KDecoration2::ColorRole::Frame));
-    QImage pinUpImg  = QImage(16, 16, QImage::Format_ARGB32_Premultiplied);
-    p.begin( &pinUpImg );
-    drawColorBitmaps( &p, *g, 0, 0, 16, 16, pinup_white_bits, pinup_gray_bits, pinup_dgray_bits );
-    p.end();
-    pinUpPix = new QPixmap(QPixmap::fromImage(pinUpImg));
-    pinUpPix->setMask( QBitmap::fromData(QSize( 16, 16 ), pinup_mask_bits) );
+static int decorationCount = 0;
 
-    QImage pinDownImg  = QImage(16, 16, QImage::Format_ARGB32_Premultiplied);
-    p.begin( &pinDownImg );
-    drawColorBitmaps( &p, *g, 0, 0, 16, 16, pindown_white_bits, pindown_gray_bits, pindown_dgray_bits );
-    p.end();
-    pinDownPix = new QPixmap(QPixmap::fromImage(pinDownImg));
-    pinDownPix->setMask( QBitmap::fromData(QSize( 16, 16 ), pindown_mask_bits) );
+static int titleBarHeight(Decoration *d)
+{
+    int titleHeight = qRound(1.25 * d->settings()->fontMetrics().height());
+    if (titleHeight < 19)
+        titleHeight = 19;
+    return titleHeight;
+}
 
-    delete g;
+// Side and bottom border widths for the configured border size. Maximized
+// windows are borderless apart from the titlebar. The borders are those of
+// the unshaded window, shaded windows drop the bottom one, see updateShade().
+QMargins frameBorders(Decoration *d)
+{
+    if (d->client().data()->isMaximized())
+        return QMargins();
+
+    int side = normalSide;
+    int bottom = normalBottom;
+    switch (d->settings()->borderSize()) {
+    case KDecoration2::BorderSize::None:
+        side = bottom = 0;
+        break;
+    case KDecoration2::BorderSize::NoSides:
+        side = 0;
+        break;
+    case KDecoration2::BorderSize::Tiny:
+        side /= 2;
+        bottom /= 2;
+        break;
+    case KDecoration2::BorderSize::Normal:
+        break;
+    case KDecoration2::BorderSize::Large:
+        side += 2;
+        bottom += 2;
+        break;
+    case KDecoration2::BorderSize::VeryLarge:
+        side += 4;
+        bottom += 4;
+        break;
+    case KDecoration2::BorderSize::Huge:
+        side += 6;
+        bottom += 6;
+        break;
+    case KDecoration2::BorderSize::VeryHuge:
+        side += 8;
+        bottom += 8;
+        break;
+    case KDecoration2::BorderSize::Oversized:
+        side += 12;
+        bottom += 12;
+        break;
+    }
+    return QMargins(side, 0, side, bottom);
 }
-int getBottom(Decoration *d)
+
+// Repaint diagnostics, enabled by setting KDE2_PAINT_STATS in the environment.
+// Every paint is attributed to the trigger that requested it, and the pixels
+// touched by the painting code, estimated from the bounding rects of the
+// painted primitives, are compared with the requested repaint area. With
+// KDE2_PAINT_STATS=overlay the overdrawn pixels are tinted by trigger.
+class PaintStats
+{
+public:
+    static PaintStats *self();
+
+    bool overlay() const { return m_overlay; }
+    void damaged(RepaintTrigger trigger, qint64 area);
+    void painted(RepaintTrigger trigger, const QRect &repaintArea, qint64 touched);
+
+private:
+    explicit PaintStats(bool overlay);
+    void dump() const;
+
+    // histogram bucket n counts repaint areas of [2^n, 2^(n+1)) pixels
+    enum { HistogramBuckets = 24, DumpInterval = 500 };
+
+    struct Entry {
+        quint64 requests;
+        quint64 damaged;
+        quint64 paints;
+        quint64 requested;
+        quint64 touched;
+        quint64 histogram[HistogramBuckets];
+    };
+
+    bool m_overlay;
+    quint64 m_paints;
+    Entry m_entries[RepaintTriggerCount];
+};
+
+PaintStats *PaintStats::self()
+{
+    static const QByteArray mode = qgetenv("KDE2_PAINT_STATS");
+    if (mode.isEmpty() || mode == "0") {
+        return Q_NULLPTR;
+    }
+    static PaintStats stats(mode == "overlay");
+    return &stats;
+}
+
+PaintStats::PaintStats(bool overlay)
+    : m_overlay(overlay)
+    , m_paints(0)
+    , m_entries()
 {
-    return d->client().data()->isMaximized() ? side : bottom_;
+}
+
+void PaintStats::damaged(RepaintTrigger trigger, qint64 area)
+{
+    Entry &entry = m_entries[trigger];
+    ++entry.requests;
+    entry.damaged += area;
+}
+
+void PaintStats::painted(RepaintTrigger trigger, const QRect &repaintArea, qint64 touched)
+{
+    const qint64 area = qint64(repaintArea.width()) * repaintArea.height();
+    int bucket = 0;
+    while (bucket < HistogramBuckets - 1 && (qint64(2) << bucket) <= area)
+        ++bucket;
+
+    Entry &entry = m_entries[trigger];
+    ++entry.paints;
+    entry.requested += area;
+    entry.touched += touched;
+    ++entry.histogram[bucket];
+
+    if (++m_paints % DumpInterval == 0)
+        dump();
+}
+
+void PaintStats::dump() const
+{
+    static const char *const names[RepaintTriggerCount] = {
+        "other", "hover", "caption", "activation", "resize", "palette", "mixed"
+    };
+
+    qDebug("kde2 decoration: paint statistics after %llu paints", m_paints);
+    for (int i = 0; i < RepaintTriggerCount; ++i) {
+        const Entry &entry = m_entries[i];
+        if (!entry.paints && !entry.requests)
+            continue;
+        QString histogram;
+        for (int bucket = 0; bucket < HistogramBuckets; ++bucket) {
+            if (entry.histogram[bucket])
+                histogram += QStringLiteral(" %1:%2").arg(1 << bucket).arg(entry.histogram[bucket]);
+        }
+        qDebug("  %-10s damage requests %llu, damaged %llu px, paints %llu, requested %llu px, touched %llu px (overdraw %.2f), sizes%s",
+               names[i], entry.requests, entry.damaged, entry.paints, entry.requested, entry.touched,
+               entry.requested ? double(entry.touched) / entry.requested : 0.0,
+               qPrintable(histogram));
+    }
 }
 
 QVariantMap ThemeLister::themes() const
@@ -260,8 +782,12 @@ QVariantMap ThemeLister::themes() const
 
 Decoration::Decoration(QObject *parent, const QVariantList &args)
     : KDecoration2::Decoration(parent, args)
+    , m_titleHeight(19)
+    , m_titleLayerState(-1)
+    , m_captionLayer()
     , m_leftButtons(new KDecoration2::DecorationButtonGroup(this))
     , m_rightButtons(new KDecoration2::DecorationButtonGroup(this))
+    , buttonSize(16)
 {
     if (!args.isEmpty()) {
         QVariantMap map = args.at(0).toMap();
@@ -271,37 +797,17 @@ Decoration::Decoration(QObject *parent, const QVariantList &args)
         }
     }
 
-    titlePix = NULL;
-    rightBtnUpPix[true]     = NULL;
-    rightBtnDownPix[true] = NULL;
-    leftBtnUpPix[true]  = NULL;
-    leftBtnDownPix[true]    = NULL;
-    pinUpPix = NULL;
-    pinDownPix = NULL;
+    for (int active = 0; active < 2; ++active) {
+        m_assetsWatcher[active] = new QFutureWatcher<AssetsPtr>(this);
+        m_assetsPending[active] = false;
+    }
+    ++decorationCount;
 }
 
 Decoration::~Decoration()
 {
-    // Free button pixmaps
-    if (rightBtnUpPix[true])
-        delete rightBtnUpPix[true];
-    if(rightBtnDownPix[true])
-        delete rightBtnDownPix[true];
-
-    if (leftBtnUpPix[true])
-        delete leftBtnUpPix[true];
-    if(leftBtnDownPix[true])
-        delete leftBtnDownPix[true];
-
-    // Title images
-    if (titlePix)
-        delete titlePix;
-
-    // Sticky pin images
-    if (pinUpPix)
-        delete pinUpPix;
-    if (pinDownPix)
-        delete pinDownPix;
+    if (--decorationCount == 0)
+        waitForAssets();
 }
 
 void Decoration::init()
@@ -311,6 +817,8 @@ void Decoration::init()
     connect(settings().data(), &KDecoration2::DecorationSettings::reconfigured, this, &Decoration::recreateButtons);
 
     connect(settings().data(), &KDecoration2::DecorationSettings::fontChanged, this, &Decoration::updateButtons);
+    // only the frame geometry depends on the border size
+    connect(settings().data(), &KDecoration2::DecorationSettings::borderSizeChanged, this, [this]() { updateLayout(); update(); });
     connect(settings().data(), &KDecoration2::DecorationSettings::onAllDesktopsAvailableChanged, this, &Decoration::updateButtons);
     connect(client().data(), &KDecoration2::DecoratedClient::shadeableChanged, this, &Decoration::updateButtons);
     connect(client().data(), &KDecoration2::DecoratedClient::providesContextHelpChanged, this, &Decoration::updateButtons);
@@ -318,58 +826,261 @@ void Decoration::init()
     connect(client().data(), &KDecoration2::DecoratedClient::maximizeableChanged, this, &Decoration::updateButtons);
     connect(client().data(), &KDecoration2::DecoratedClient::closeableChanged, this, &Decoration::updateButtons);
 
-    connect(client().data(), &KDecoration2::DecoratedClient::widthChanged, this, &Decoration::updateLayout);
-    connect(client().data(), &KDecoration2::DecoratedClient::heightChanged, this, &Decoration::updateLayout);
+    auto resized = [this]() {
+        updateLayout();
+        if (PaintStats::self())
+            m_pendingDamage[ResizeRepaint] = rect();
+    };
+    connect(client().data(), &KDecoration2::DecoratedClient::widthChanged, this, resized);
+    connect(client().data(), &KDecoration2::DecoratedClient::heightChanged, this, resized);
     // change button pixmaps
     connect(client().data(), &KDecoration2::DecoratedClient::maximizedChanged, this, &Decoration::updateButtons);
-    connect(client().data(), &KDecoration2::DecoratedClient::shadedChanged, this, &Decoration::updateButtons);
+    connect(client().data(), &KDecoration2::DecoratedClient::shadedChanged, this, &Decoration::updateShade);
     connect(client().data(), &KDecoration2::DecoratedClient::keepBelowChanged, this, &Decoration::updateButtons);
     connect(client().data(), &KDecoration2::DecoratedClient::keepAboveChanged, this, &Decoration::updateButtons);
     //
 
     // recolor button and pin icon backgrounds
-    connect(client().data(), &KDecoration2::DecoratedClient::paletteChanged, this, [this]() { update(); Decoration::updateButtons(); });
+    connect(client().data(), &KDecoration2::DecoratedClient::paletteChanged, this, [this]() { loadAssets(true); });
     connect(client().data(), &KDecoration2::DecoratedClient::iconChanged, this, [this]() { update(); });
-    connect(client().data(), &KDecoration2::DecoratedClient::captionChanged, this, [this]() { update(m_captionRect); });
-    // recolor button and pin icon backgrounds
-    connect(client().data(), &KDecoration2::DecoratedClient::activeChanged, this, [this]() { update(); Decoration::updateButtons(); });
+    connect(client().data(), &KDecoration2::DecoratedClient::captionChanged, this, [this]() {
+        QRect damage = captionDamage();
+        if (!damage.isEmpty())
+            requestRepaint(CaptionRepaint, damage);
+    });
+    // assets for both color groups are prepared, so only repaint
+    connect(client().data(), &KDecoration2::DecoratedClient::activeChanged, this, [this]() { requestRepaint(ActivationRepaint, frameRegion()); });
+
+    // keep painting with the old assets until the new ones are rendered
+    for (int active = 0; active < 2; ++active) {
+        connect(m_assetsWatcher[active], &QFutureWatcherBase::finished, this, [this, active]() {
+            if (!m_assetsPending[active])
+                return;
+            m_assetsPending[active] = false;
+            m_assets[active] = m_assetsWatcher[active]->result();
+            m_colors[active] = m_pendingColors[active];
+            // the watcher would keep this set alive after it is replaced
+            m_assetsWatcher[active]->setFuture(QFuture<AssetsPtr>());
+            m_titleLayer = QImage();
+            if (client().data()->isActive() == bool(active))
+                requestRepaint(PaletteRepaint, frameRegion());
+        });
+    }
 
-    createButtons();
+    syncButtons(m_leftButtons, settings()->decorationButtonsLeft());
+    syncButtons(m_rightButtons, settings()->decorationButtonsRight());
     updateButtons();
 }
 
-void Decoration::createButtons()
+void Decoration::loadAssets(bool async)
 {
-    QVector<KDecoration2::DecorationButtonType> buttons;
+    KDecoration2::DecoratedClient *c = client().data();
+
+    // request both sets first, so they are rendered in parallel
+    QFuture<AssetsPtr> futures[2];
+    for (int active = 0; active < 2; ++active) {
+        KDecoration2::ColorGroup colorGroup = (active ? KDecoration2::ColorGroup::Active : KDecoration2::ColorGroup::Inactive);
+
+        // the frame is painted with these once the assets are there
+        FrameColors &colors = async ? m_pendingColors[active] : m_colors[active];
+        colors.titleBar = c->color(colorGroup, KDecoration2::ColorRole::TitleBar);
+        colors.frame = c->color(colorGroup, KDecoration2::ColorRole::Frame);
+        colors.foreground = c->color(colorGroup, KDecoration2::ColorRole::Foreground);
+        colors.window = c->color(QPalette::Active, QPalette::Window);
+
+        AssetKey key;
+        key.titleBar = colors.titleBar.rgba();
+        key.frame = colors.frame.rgba();
+        key.stipple = c->color(KDecoration2::ColorGroup::Active, KDecoration2::ColorRole::TitleBar).rgba();
+        key.buttonSize = buttonSize;
+        key.titleHeight = m_titleHeight + top;
+
+        futures[active] = assetsFor(key);
+    }
 
-    buttons = settings()->decorationButtonsLeft();
-    for (int i = 0; i < buttons.size(); ++i) {
-        m_leftButtons->addButton(new DecorationButton(buttons.at(i), this, m_leftButtons));
+    for (int active = 0; active < 2; ++active) {
+        // a synchronous load supersedes any asynchronous one still in flight
+        m_assetsPending[active] = async;
+        if (async) {
+            m_assetsWatcher[active]->setFuture(futures[active]);
+        } else {
+            m_assets[active] = futures[active].result();
+            // drop the set of a superseded asynchronous load
+            m_assetsWatcher[active]->setFuture(QFuture<AssetsPtr>());
+        }
     }
-    buttons = settings()->decorationButtonsRight();
-    for (int i = 0; i < buttons.size(); ++i) {
-        m_rightButtons->addButton(new DecorationButton(buttons.at(i), this, m_rightButtons));
+}
+
+// Attributes damage to a trigger. Damage that KDecoration2 requests itself,
+// e.g. for button state changes, is only counted.
+void Decoration::countRepaint(RepaintTrigger trigger, const QRect &rect)
+{
+    if (PaintStats *stats = PaintStats::self()) {
+        m_pendingDamage[trigger] += rect;
+        stats->damaged(trigger, qint64(rect.width()) * rect.height());
     }
 }
 
-void Decoration::deleteButtons()
+void Decoration::requestRepaint(RepaintTrigger trigger, const QRegion &region)
 {
-    int size;
-    size = m_leftButtons->buttons().size();
-    while (size) {
-        m_leftButtons->removeButton(m_leftButtons->buttons().at(--size));
+    if (region.isEmpty()) {
+        countRepaint(trigger, rect());
+        update();
+        return;
     }
-    size = m_rightButtons->buttons().size();
-    while (size) {
-        m_rightButtons->removeButton(m_rightButtons->buttons().at(--size));
+    for (QRegion::const_iterator it = region.begin(); it != region.end(); ++it) {
+        countRepaint(trigger, *it);
+        update(*it);
     }
 }
 
+// The decoration without the client area, everything a palette or an
+// activation change can recolor
+QRegion Decoration::frameRegion() const
+{
+    const QRect frame = rect();
+    return QRegion(frame) - QRegion(frame.marginsRemoved(borders()));
+}
+
+// Whether the text has any right-to-left characters, QString::isRightToLeft()
+// only looks at the first strong one
+static bool hasRightToLeft(const QString &text)
+{
+    for (int i = 0; i < text.size(); ++i) {
+        switch (text.at(i).direction()) {
+        case QChar::DirR:
+        case QChar::DirAL:
+        case QChar::DirRLE:
+        case QChar::DirRLO:
+        case QChar::DirRLI:
+            return true;
+        default:
+            break;
+        }
+    }
+    return false;
+}
+
+// The part of the caption that differs from the painted one: from the first
+// changed character to the end of the longer text, the stipple starts there
+QRect Decoration::captionDamage() const
+{
+    const CaptionLayer &layer = m_captionLayer;
+    if (layer.image.isNull())
+        return m_captionRect;
+
+    QRect captionRect = m_captionRect.adjusted(4, 0, -4, 0);
+    const QString elided = settings()->fontMetrics().elidedText(client().data()->caption(), Qt::ElideMiddle, captionRect.width());
+    if (elided == layer.text)
+        return QRect();
+    // the offsets below only hold for left-to-right text in a left-to-right
+    // layout, bidirectional text is reordered and may move as a whole
+    if (QGuiApplication::layoutDirection() == Qt::RightToLeft || hasRightToLeft(elided) || hasRightToLeft(layer.text))
+        return m_captionRect;
+
+    int prefix = 0;
+    while (prefix < elided.size() && prefix < layer.text.size() && elided.at(prefix) == layer.text.at(prefix))
+        ++prefix;
+
+    // glyphs can overhang their advance by a pixel or two
+    QFontMetrics fm(settings()->font());
+    int left = captionRect.x() + fm.width(elided.left(prefix)) - 2;
+    int right = captionRect.x() + qMax(fm.width(elided), layer.width) + 2;
+    return QRect(QPoint(left, m_captionRect.top()), QPoint(right, m_captionRect.bottom())) & m_captionRect;
+}
+
+// Bring a button group in line with the configured button types. Existing
+// buttons are reused, only added types are created and removed ones deleted.
+// Buttons that keep their place stay in the group: addButton() connects the
+// button to the group's relayout every time and removeButton() does not
+// disconnect it, so buttons are only taken out and added back where the
+// order changes.
+bool Decoration::syncButtons(KDecoration2::DecorationButtonGroup *group, const QVector<KDecoration2::DecorationButtonType> &types)
+{
+    const QVector<QPointer<KDecoration2::DecorationButton>> buttons = group->buttons();
+
+    // the buttons in front that are already where they belong
+    int kept = 0;
+    while (kept < buttons.size() && kept < types.size() && buttons.at(kept)->type() == types.at(kept)) {
+        ++kept;
+    }
+    if (kept == buttons.size() && kept == types.size()) {
+        return false;
+    }
+
+    QVector<QPointer<KDecoration2::DecorationButton>> unused;
+    for (int i = kept; i < buttons.size(); ++i) {
+        group->removeButton(buttons.at(i));
+        QObject::disconnect(buttons.at(i), Q_NULLPTR, group, Q_NULLPTR);
+        unused.append(buttons.at(i));
+    }
+    for (int i = kept; i < types.size(); ++i) {
+        DecorationButton *button = Q_NULLPTR;
+        for (int j = 0; j < unused.size(); ++j) {
+            if (unused.at(j)->type() == types.at(i)) {
+                button = qobject_cast<DecorationButton *>(unused.at(j));
+                unused.remove(j);
+                break;
+            }
+        }
+        if (!button) {
+            button = new DecorationButton(types.at(i), this, group);
+            updateButton(button);
+        }
+        group->addButton(button);
+    }
+    for (int i = 0; i < unused.size(); ++i) {
+        delete unused.at(i).data();
+    }
+    return true;
+}
+
 void Decoration::recreateButtons()
 {
-    deleteButtons();
-    createButtons();
-    updateButtons();
+    bool changed = syncButtons(m_leftButtons, settings()->decorationButtonsLeft());
+    changed = syncButtons(m_rightButtons, settings()->decorationButtonsRight()) || changed;
+    if (changed) {
+        updateLayout();
+        update();
+    }
+}
+
+void Decoration::updateButton(DecorationButton *button)
+{
+    switch (button->type()) {
+    case KDecoration2::DecorationButtonType::OnAllDesktops:
+        button->setVisible(settings()->isOnAllDesktopsAvailable());
+        break;
+    case KDecoration2::DecorationButtonType::Shade:
+        button->setVisible(client().data()->isShadeable());
+        button->setBitmap( client().data()->isShaded() ? shade_on_bits : shade_off_bits );
+        break;
+    case KDecoration2::DecorationButtonType::ContextHelp:
+        button->setVisible(client().data()->providesContextHelp());
+        button->setBitmap(question_bits);
+        break;
+    case KDecoration2::DecorationButtonType::Minimize:
+        button->setVisible(client().data()->isMinimizeable());
+        button->setBitmap(iconify_bits);
+        break;
+    case KDecoration2::DecorationButtonType::Maximize:
+        button->setVisible(client().data()->isMaximizeable());
+        button->setBitmap( client().data()->isMaximized() ? minmax_bits : maximize_bits );
+        break;
+    case KDecoration2::DecorationButtonType::Close:
+        button->setVisible(client().data()->isCloseable());
+        button->setBitmap(close_bits);
+        break;
+    case KDecoration2::DecorationButtonType::KeepBelow:
+        button->setBitmap( client().data()->isKeepBelow() ? below_on_bits : below_off_bits );
+        break;
+    case KDecoration2::DecorationButtonType::KeepAbove:
+        button->setBitmap( client().data()->isKeepAbove() ? above_on_bits : above_off_bits );
+        break;
+    default:
+        break;
+    }
+    button->setGeometry(QRect(0, 0, buttonSize, buttonSize));
 }
 
 void Decoration::updateButtons()
@@ -381,83 +1092,46 @@ void Decoration::updateButtons()
     buttonSize = settings()->fontMetrics().height();
     if (buttonSize < 16)
         buttonSize = 16;
+    m_titleHeight = titleBarHeight(this);
 
-    if (rightBtnUpPix[true])
-        delete rightBtnUpPix[true];
-    if(rightBtnDownPix[true])
-        delete rightBtnDownPix[true];
-    if (leftBtnUpPix[true])
-        delete leftBtnUpPix[true];
-    if(leftBtnDownPix[true])
-        delete leftBtnDownPix[true];
-
-    // Cache all possible button states
-    leftBtnUpPix[true]  = new QPixmap(buttonSize, buttonSize);
-    leftBtnDownPix[true]    = new QPixmap(buttonSize, buttonSize);
-
-    rightBtnUpPix[true]     = new QPixmap(buttonSize, buttonSize);
-    rightBtnDownPix[true] = new QPixmap(buttonSize, buttonSize);
-
-    QPalette *g;
-    KDecoration2::ColorGroup colorGroup = (client().data()->isActive() ? KDecoration2::ColorGroup::Active : KDecoration2::ColorGroup::Inactive);
-
-    // Draw the button state pixmaps
-    g = new QPalette(client().data()->color(colorGroup, KDecoration2::ColorRole::TitleBar));
-    drawButtonBackground( leftBtnUpPix[true], *g, false );
-    drawButtonBackground( leftBtnDownPix[true], *g, true );
-
-    delete g;
+    for (int i = 0; i < buttons.size(); ++i) {
+        updateButton(qobject_cast<DecorationButton *>(buttons.at(i)));
+    }
 
-    g = new QPalette(client().data()->color(colorGroup, KDecoration2::ColorRole::Frame));
-    drawButtonBackground( rightBtnUpPix[true], *g, false );
-    drawButtonBackground( rightBtnDownPix[true], *g, true );
+    // the font may have changed
+    invalidateLayers();
+    updateLayout();
+    loadAssets(false);
+}
 
-    delete g;
+// Shading only swaps the shade glyph and drops or restores the bottom border.
+// The titlebar layout is the same in both states, so nothing is laid out
+// again and only the titlebar layer is redrawn.
+void Decoration::updateShade()
+{
+    QVector<QPointer<KDecoration2::DecorationButton>> buttons;
+    buttons.append(m_leftButtons->buttons());
+    buttons.append(m_rightButtons->buttons());
 
     for (int i = 0; i < buttons.size(); ++i) {
-        DecorationButton *button = qobject_cast<DecorationButton *>(buttons.at(i));
-        switch (button->type()) {
-        case KDecoration2::DecorationButtonType::OnAllDesktops:
-            button->setVisible(settings()->isOnAllDesktopsAvailable());
-            break;
-        case KDecoration2::DecorationButtonType::Shade:
-            button->setVisible(client().data()->isShadeable());
-            button->setBitmap( client().data()->isShaded() ? shade_on_bits : shade_off_bits );
-            break;
-        case KDecoration2::DecorationButtonType::ContextHelp:
-            button->setVisible(client().data()->providesContextHelp());
-            button->setBitmap(question_bits);
-            break;
-        case KDecoration2::DecorationButtonType::Minimize:
-            button->setVisible(client().data()->isMinimizeable());
-            button->setBitmap(iconify_bits);
-            break;
-        case KDecoration2::DecorationButtonType::Maximize:
-            button->setVisible(client().data()->isMaximizeable());
-            button->setBitmap( client().data()->isMaximized() ? minmax_bits : maximize_bits );
-            break;
-        case KDecoration2::DecorationButtonType::Close:
-            button->setVisible(client().data()->isCloseable());
-            button->setBitmap(close_bits);
-            break;
-        case KDecoration2::DecorationButtonType::KeepBelow:
-            button->setBitmap( client().data()->isKeepBelow() ? below_on_bits : below_off_bits );
-            break;
-        case KDecoration2::DecorationButtonType::KeepAbove:
-            button->setBitmap( client().data()->isKeepAbove() ? above_on_bits : above_off_bits );
-            break;
-        default:
-            break;
-        }
-        button->setGeometry(QRect(0, 0, buttonSize, buttonSize));
+        if (buttons.at(i)->type() == KDecoration2::DecorationButtonType::Shade)
+            updateButton(qobject_cast<DecorationButton *>(buttons.at(i)));
     }
 
-    updateLayout();
-    createPixmaps();
+    QMargins borders = m_borders;
+    if (client().data()->isShaded())
+        borders.setBottom(0);
+    setBorders(borders);
+    m_frameRect = QRect(0, 0, size().width(), size().height());
 }
 
 void Decoration::updateLayout()
 {
+    const QRect oldCaptionRect = m_captionRect;
+    const QMargins oldBorders = borders();
+    const int oldWidth = m_frameRect.width();
+    const bool wasOpaque = isOpaque();
+
     bool isMaximized = client().data()->isMaximized();
     setOpaque(isMaximized);
 
@@ -467,11 +1141,14 @@ void Decoration::updateLayout()
     }
 #endif
 
-    //int frame = settings()->fontMetrics().height() / 5;
-    int titleHeight = qRound(1.25 * settings()->fontMetrics().height());
-    if (titleHeight < 19)
-        titleHeight = 19;
-    setBorders(QMargins(side, titleHeight + top, side, getBottom(this)));
+    int titleHeight = m_titleHeight;
+    m_borders = frameBorders(this);
+    int side = m_borders.left();
+    m_borders.setTop(titleHeight + top);
+    QMargins borders = m_borders;
+    if (client().data()->isShaded())
+        borders.setBottom(0);
+    setBorders(borders);
 
     m_frameRect = QRect(0, 0, size().width(), size().height());
     setTitleBar(QRect(side, top, size().width() - 2 * side, borderTop()));
@@ -482,35 +1159,18 @@ void Decoration::updateLayout()
     int left = m_leftButtons->geometry().x() + m_leftButtons->geometry().width();
     m_captionRect = QRect(left, 0, m_rightButtons->geometry().x() - left, titleHeight + top);
 
-    if (titlePix)
-        delete titlePix;
-
-    // Make the titlebar stipple
-        QPainter p;
-        QPainter maskPainter;
-        int i, x, y;
-        titlePix = new QPixmap(132, m_captionRect.height());
-        titlePix->fill( Qt::transparent );
-
-        QBitmap mask(132, m_captionRect.height());
-        mask.fill(Qt::color0);
-
-        p.begin(titlePix);
-        maskPainter.begin(&mask);
-        maskPainter.setPen(Qt::color1);
-        for(i=0, y=2; i < m_captionRect.height()/4; ++i, y+=4)
-            for(x=1; x <= 132; x+=3)
-            {
-                p.setPen(client().data()->color(KDecoration2::ColorGroup::Active, KDecoration2::ColorRole::TitleBar).light(150));
-                p.drawPoint(x, y);
-                maskPainter.drawPoint(x, y);
-                p.setPen(client().data()->color(KDecoration2::ColorGroup::Active, KDecoration2::ColorRole::TitleBar).dark(150));
-                p.drawPoint(x+1, y+1);
-                maskPainter.drawPoint(x+1, y+1);
-            }
-        maskPainter.end();
-        p.end();
-        titlePix->setMask(mask);
+    // the titlebar layers do not depend on the height, so interactive
+    // resizing and shading keep them
+    if (m_captionRect != oldCaptionRect || m_frameRect.width() != oldWidth || isOpaque() != wasOpaque
+        || borders().left() != oldBorders.left() || borders().top() != oldBorders.top()) {
+        invalidateLayers();
+    }
+}
+
+void Decoration::invalidateLayers()
+{
+    m_titleLayer = QImage();
+    m_captionLayer = CaptionLayer();
 }
 
 void Decoration::createShadow()
@@ -554,31 +1214,45 @@ static void drawShadowRect(QPainter *p, const QRect &rect)
     p->fillRect(r, QColor(0, 0, 0, 50));
 }
 
-void Decoration::paint(QPainter *painter, const QRect &repaintArea)
+// Paints everything but the caption, the stipple and the buttons. For the
+// paint statistics the bounding rect of each primitive inside clip is added
+// to touched, if given.
+void Decoration::paintFrame(QPainter *painter, const QRect &clip, QVector<QRect> *touched)
 {
-    KDecoration2::ColorGroup colorGroup = (client().data()->isActive() ? KDecoration2::ColorGroup::Active : KDecoration2::ColorGroup::Inactive);
-//    painter->fillRect(m_frameRect, client().data()->color(colorGroup, KDecoration2::ColorRole::Frame));
-    QColor color = client().data()->color(colorGroup, KDecoration2::ColorRole::TitleBar);
+    auto touch = [&](const QRect &rect) {
+        if (touched && rect.intersects(clip))
+            touched->append(rect & clip);
+    };
+
+    const FrameColors &colors = m_colors[client().data()->isActive()];
+//    painter->fillRect(m_frameRect, colors.frame);
+    QColor color = colors.titleBar;
     if (!client().data()->isActive()) {
-        color = client().data()->color(QPalette::Active, QPalette::Window);
+        color = colors.window;
     }
     if (!client().data()->isMaximized()) {
         color.setAlphaF(0.9);
     }
     painter->setRenderHints(QPainter::Antialiasing, false);
     painter->fillRect(m_frameRect, color);
+    touch(m_frameRect);
 
     // Obtain widget bounds.
     QRect r(m_frameRect);
     int w  = r.width();
     int h  = r.height();
 
-    QPalette *g = new QPalette(client().data()->color(colorGroup, KDecoration2::ColorRole::Frame));
-    QPalette *g2 = new QPalette(client().data()->color(colorGroup, KDecoration2::ColorRole::TitleBar));
-    QColor c2 = client().data()->color(colorGroup, KDecoration2::ColorRole::Frame);
+    const QPalette g(colors.frame);
+    const QPalette g2(colors.titleBar);
+    QColor c2 = colors.frame;
     int leftFrameStart = m_captionRect.height()+leftFrameOffset;
-    int bottom = getBottom(this);
+    int side = borderLeft();
+    int bottom = borderBottom();
+    // shaded windows only show the titlebar strip
+    bool shaded = client().data()->isShaded();
 
+    if (side > 0 && !shaded)
+    {
     // left side
     painter->setPen(c2);
     QPolygon a;
@@ -594,69 +1268,216 @@ void Decoration::paint(QPainter *painter, const QRect &repaintArea)
     // Finish drawing the titlebar extension
     painter->setPen(Qt::black);
     painter->drawLine(0, leftFrameStart+side, side, leftFrameStart);
+    touch(a.boundingRect());
     // right side
     painter->fillRect(w-side, 0,
                side, h,
                c2 );
+    touch(QRect(w-side, 0, side, h));
+    }
 
     // Fill with frame color behind RHS buttons
     painter->fillRect( m_rightButtons->geometry().x()-sepRight, 0, m_rightButtons->geometry().width()+sepRight, m_captionRect.height(), c2);
+    touch(QRect(m_rightButtons->geometry().x()-sepRight, 0, m_rightButtons->geometry().width()+sepRight, m_captionRect.height()));
 
     // Draw the bottom handle if required
-    if (!client().data()->isMaximized())
+    if (bottom > 0)
     {
             qDrawShadePanel(painter, 0, h-bottom+1, grabWidth, bottom,
-                            *g, false, 1, &g->brush(QPalette::Mid));
+                            g, false, 1, &g.brush(QPalette::Mid));
             qDrawShadePanel(painter, grabWidth, h-bottom+1, w-2*grabWidth, bottom,
-                            *g, false, 1, client().data()->isActive() ?
-                            &g->brush(QPalette::Background) :
-                            &g->brush(QPalette::Mid));
+                            g, false, 1, client().data()->isActive() ?
+                            &g.brush(QPalette::Background) :
+                            &g.brush(QPalette::Mid));
             qDrawShadePanel(painter, w-grabWidth, h-bottom+1, grabWidth, bottom,
-                            *g, false, 1, &g->brush(QPalette::Mid));
-    } else
-        {
-            painter->fillRect(0, h-bottom, w, bottom, c2);
-        }
-
-    QRectF clipRect = painter->clipBoundingRect();
-    if (clipRect.isEmpty() || clipRect.intersects(m_captionRect)) {
-        QRect captionRect = m_captionRect.adjusted(4, 0, -4, 0);
-        QString caption = settings()->fontMetrics().elidedText(client().data()->caption(), Qt::ElideMiddle, captionRect.width());
-//        painter->fillRect(m_captionRect, client().data()->color(colorGroup, KDecoration2::ColorRole::TitleBar));
-//        painter->fillRect(m_captionRect, color);
-        painter->setPen(client().data()->color(colorGroup, KDecoration2::ColorRole::Foreground));
-        painter->setFont(settings()->font());
-        painter->drawText(captionRect, Qt::AlignVCenter, caption);
-
-    // Draw the titlebar stipple if active
-    if (client().data()->isActive())
-    {
-        QFontMetrics fm(settings()->font());
-        int captionWidth = fm.width(caption);
-        painter->drawTiledPixmap( m_captionRect.adjusted(captionWidth+4, stippleTop, -sepRight, 0), *titlePix );
-    }
-
+                            g, false, 1, &g.brush(QPalette::Mid));
+            touch(QRect(0, h-bottom+1, w, bottom));
     }
 
     drawShadowRect(painter, m_frameRect);
+    touch(m_frameRect.adjusted(0, 0, 0, 2 - m_frameRect.height()));
+    touch(m_frameRect.adjusted(0, 2, 2 - m_frameRect.width(), 0));
+    touch(m_frameRect.adjusted(m_frameRect.width() - 2, 0, 0, -2));
+    touch(m_frameRect.adjusted(0, m_frameRect.height() - 2, 0, 0));
 
     // Draw titlebar colour separator line
-    painter->setPen(g2->color( QPalette::Dark ));
+    painter->setPen(g2.color( QPalette::Dark ));
     painter->drawLine(m_rightButtons->geometry().x()-1-sepRight, 0, m_rightButtons->geometry().x()-1-sepRight, m_captionRect.height());
+    touch(QRect(m_rightButtons->geometry().x()-1-sepRight, 0, 1, m_captionRect.height() + 1));
 
     // Draw an outer black frame
     painter->setPen(Qt::black);
     painter->drawRect(0,0,w-1,h-1);
+    touch(QRect(0, 0, w, 1));
+    touch(QRect(0, h-1, w, 1));
+    touch(QRect(0, 1, 1, h-2));
+    touch(QRect(w-1, 1, 1, h-2));
 
     // Draw a frame around the wrapped widget.
-    painter->setPen( g->color( QPalette::Dark ) );
+    if (!shaded)
+    {
+    painter->setPen( g.color( QPalette::Dark ) );
     painter->drawRect( side-1,m_captionRect.height()-1,w-2*side+1,h-m_captionRect.height()-bottom+1 );
+    touch(QRect(side-1, m_captionRect.height()-1, w-2*side+2, 1));
+    touch(QRect(side-1, h-bottom, w-2*side+2, 1));
+    touch(QRect(side-1, m_captionRect.height(), 1, h-m_captionRect.height()-bottom));
+    touch(QRect(w-side, m_captionRect.height(), 1, h-m_captionRect.height()-bottom));
+    }
+}
+
+// The elided caption text on a transparent layer at the device pixel ratio
+// of the output. It only spans the text, which seldom fills the caption rect,
+// and is redrawn when the color changes with the focus.
+void Decoration::updateCaptionLayer(const QColor &color, qreal devicePixelRatio)
+{
+    CaptionLayer &layer = m_captionLayer;
+    if (m_captionRect.isEmpty()) {
+        layer = CaptionLayer();
+        return;
+    }
+    const QString caption = client().data()->caption();
+    if (!layer.image.isNull() && layer.caption == caption && layer.color == color.rgba()
+        && layer.size == m_captionRect.size() && layer.image.devicePixelRatio() == devicePixelRatio)
+        return;
+    layer.caption = caption;
+    layer.color = color.rgba();
+    layer.size = m_captionRect.size();
+
+    QRect captionRect = QRect(QPoint(0, 0), m_captionRect.size()).adjusted(4, 0, -4, 0);
+    QString elided = settings()->fontMetrics().elidedText(caption, Qt::ElideMiddle, captionRect.width());
+    QFontMetrics fm(settings()->font());
+    layer.text = elided;
+    layer.width = fm.width(elided);
+
+    // glyphs can overhang their advance by a pixel or two
+    const QSize size(qMin(layer.width + 8 + 2, m_captionRect.width()), m_captionRect.height());
+    layer.image = QImage(size * devicePixelRatio, QImage::Format_ARGB32_Premultiplied);
+    layer.image.setDevicePixelRatio(devicePixelRatio);
+    layer.image.fill(Qt::transparent);
+    QPainter p(&layer.image);
+    p.setPen(color);
+    p.setFont(settings()->font());
+    p.drawText(captionRect, Qt::AlignVCenter, elided);
+}
+
+// The titlebar is composed from cached layers: the frame behind it, the
+// caption text, the stipple tile and the per-button backgrounds and glyphs.
+// Only the layers intersecting the repaint area are drawn.
+void Decoration::paint(QPainter *painter, const QRect &repaintArea)
+{
+    PaintStats *stats = PaintStats::self();
+    // the parts of the repaint area covered by each painted primitive,
+    // estimated by their bounding rects
+    QVector<QRect> touched;
+    auto touch = [&](const QRect &rect) {
+        if (stats && rect.intersects(repaintArea))
+            touched.append(rect & repaintArea);
+    };
+
+    bool active = client().data()->isActive();
+    int w = m_frameRect.width();
+    int h = m_frameRect.height();
+    QRect titleRect(0, 0, w, m_captionRect.height());
+    QRect bodyRect(0, titleRect.height(), w, h - titleRect.height());
+
+    // the frame below the titlebar is painted directly
+    if (bodyRect.intersects(repaintArea)) {
+        painter->save();
+        painter->setClipRect(bodyRect, Qt::IntersectClip);
+        paintFrame(painter, bodyRect & repaintArea, stats ? &touched : Q_NULLPTR);
+        painter->restore();
+    }
+
+    // layers are rendered at the scale of the output, so they stay sharp
+    const qreal dpr = painter->device()->devicePixelRatioF();
+    if (titleRect.intersects(repaintArea)) {
+        // only the layer of the current state is kept, a window spends most
+        // of its time in one, and the outer frame of shaded windows runs
+        // through the titlebar
+        const int state = (client().data()->isShaded() ? 2 : 0) | (active ? 1 : 0);
+        QImage &layer = m_titleLayer;
+        if (layer.isNull() || m_titleLayerState != state || layer.devicePixelRatio() != dpr) {
+            m_titleLayerState = state;
+            layer = QImage(titleRect.size() * dpr, QImage::Format_ARGB32_Premultiplied);
+            layer.setDevicePixelRatio(dpr);
+            layer.fill(Qt::transparent);
+            QPainter p(&layer);
+            paintFrame(&p, titleRect, Q_NULLPTR);
+        }
+        QRect rect = titleRect & repaintArea;
+        painter->drawImage(QRectF(rect), layer, QRectF(rect.x() * dpr, rect.y() * dpr, rect.width() * dpr, rect.height() * dpr));
+        touch(rect);
+    }
+
+    if (m_captionRect.intersects(repaintArea)) {
+        updateCaptionLayer(m_colors[active].foreground, dpr);
+        const CaptionLayer &caption = m_captionLayer;
 
-    delete g;
-    delete g2;
+    // Draw the titlebar stipple if active, it ends before the separator line
+    // and the client frame painted into the titlebar layer. The pattern is
+    // anchored to the caption rect, so a caption change only repaints the
+    // span that moved.
+    if (active)
+    {
+        QRect stippleRect = m_captionRect.adjusted(caption.width+4, stippleTop, -sepRight-1, client().data()->isShaded() ? 0 : -1);
+        QPoint brushOrigin = painter->brushOrigin();
+        painter->setBrushOrigin(m_captionRect.x(), stippleRect.y());
+        painter->fillRect(stippleRect & repaintArea, QBrush(m_assets[true]->title));
+        painter->setBrushOrigin(brushOrigin);
+        touch(stippleRect);
+    }
+
+        painter->drawImage(m_captionRect.topLeft(), caption.image);
+        touch(m_captionRect.adjusted(4, 0, 4 + caption.width - m_captionRect.width(), 0));
+    }
 
     m_leftButtons->paint(painter, repaintArea);
     m_rightButtons->paint(painter, repaintArea);
+    if (stats) {
+        QVector<QPointer<KDecoration2::DecorationButton>> buttons;
+        buttons.append(m_leftButtons->buttons());
+        buttons.append(m_rightButtons->buttons());
+        for (int i = 0; i < buttons.size(); ++i) {
+            if (buttons.at(i)->isVisible())
+                touch(buttons.at(i)->geometry().toRect());
+        }
+    }
+
+    if (stats) {
+        // KWin paints one damage in several parts, e.g. once per border, so
+        // a paint is attributed to the triggers whose pending damage it
+        // covers, and only that part of their damage is consumed
+        RepaintTrigger trigger = OtherRepaint;
+        for (int i = 0; i < RepaintTriggerCount; ++i) {
+            if (!m_pendingDamage[i].intersects(repaintArea))
+                continue;
+            trigger = trigger == OtherRepaint ? RepaintTrigger(i) : MixedRepaint;
+            m_pendingDamage[i] -= repaintArea;
+        }
+
+        // the overlay shows the pixels painted more than once
+        QRegion once;
+        QRegion overdrawn;
+        qint64 pixels = 0;
+        for (int i = 0; i < touched.size(); ++i) {
+            const QRect &rect = touched.at(i);
+            pixels += qint64(rect.width()) * rect.height();
+            if (stats->overlay()) {
+                overdrawn += once & rect;
+                once += rect;
+            }
+        }
+        stats->painted(trigger, repaintArea, pixels);
+        if (stats->overlay()) {
+            static const QColor tints[RepaintTriggerCount] = {
+                QColor(128, 128, 128, 96), QColor(0, 255, 0, 96), QColor(0, 0, 255, 96),
+                QColor(255, 0, 0, 96), QColor(255, 255, 0, 96), QColor(255, 0, 255, 96),
+                QColor(0, 255, 255, 96)
+            };
+            for (QRegion::const_iterator it = overdrawn.begin(); it != overdrawn.end(); ++it)
+                painter->fillRect(*it, tints[trigger]);
+        }
+    }
 
     // remove corners
     if (!client().data()->isMaximized())
@@ -670,109 +1491,79 @@ void Decoration::paint(QPainter *painter, const QRect &repaintArea)
     }
 }
 
-void Decoration::updateHoverAnimation(qreal /*hoverProgress*/, const QRect &updateRect)
-{
-    update(updateRect);
-}
-
 DecorationButton::DecorationButton(KDecoration2::DecorationButtonType type, Decoration *decoration, QObject *parent)
     : KDecoration2::DecorationButton(type, decoration, parent)
-    , m_hoverProgress(0.0)
 {
-    connect(this, &KDecoration2::DecorationButton::hoveredChanged, this, [this](bool hovered) { startHoverAnimation(hovered ? 1.0 : 0.0); });
+    // KDecoration2 already repaints the whole button when the hover state
+    // changes, the glyph color follows that state, so it is only counted
+    connect(this, &KDecoration2::DecorationButton::hoveredChanged, this, [this]() {
+        if (isVisible())
+            d->countRepaint(HoverRepaint, geometry().toRect());
+    });
 
     deco        = NULL;
     d = decoration;
     b = qobject_cast<KDecoration2::DecorationButtonGroup *>(parent);
+#ifdef KDE2_COUNT_INSTANCES
+    liveButtons.ref();
+#endif
 }
 
 DecorationButton::~DecorationButton()
 {
-    if (deco)
-        delete deco;
-}
-
-qreal DecorationButton::hoverProgress() const
-{
-    return m_hoverProgress;
+#ifdef KDE2_COUNT_INSTANCES
+    liveButtons.deref();
+#endif
 }
 
-void DecorationButton::setHoverProgress(qreal hoverProgress)
+// The unpressed glyph position, pressed glyphs are offset by one pixel
+QRect DecorationButton::glyphRect() const
 {
-    if (m_hoverProgress != hoverProgress) {
-        m_hoverProgress = hoverProgress;
-        qobject_cast<Decoration *>(decoration())->updateHoverAnimation(m_hoverProgress, geometry().toRect().adjusted(-1, -1, 1, 1));
-    }
+    return QRect(geometry().x()+(geometry().width()-10)/2, geometry().y()+(geometry().height()-10)/2, 10, 10);
 }
 
-void DecorationButton::startHoverAnimation(qreal endValue)
+void DecorationButton::paint(QPainter *painter, const QRect &repaintArea)
 {
-    QPropertyAnimation *hoverAnimation = m_hoverAnimation;
-    const int hoverDuration = 150;
-
-    if (hoverAnimation) {
-        if (hoverAnimation->endValue() == endValue) {
-            return;
-        }
-        hoverAnimation->stop();
-    } else if (m_hoverProgress != endValue) {
-        if (hoverDuration < 10) {
-            setHoverProgress(endValue);
-            return;
-        }
-        hoverAnimation = new QPropertyAnimation(this, "hoverProgress");
-        m_hoverAnimation = hoverAnimation;
-    } else {
+    if (!geometry().toRect().intersects(repaintArea))
         return;
-    }
-    hoverAnimation->setEasingCurve(QEasingCurve::OutQuad);
-    hoverAnimation->setStartValue(m_hoverProgress);
-    hoverAnimation->setEndValue(endValue);
-    hoverAnimation->setDuration(1 + qRound(hoverDuration * qAbs(m_hoverProgress - endValue)));
-    hoverAnimation->start();
-}
 
-void DecorationButton::paint(QPainter *painter, const QRect &/*repaintArea*/)
-{
-    KDecoration2::ColorGroup colorGroup = decoration()->client().data()->isActive() ? KDecoration2::ColorGroup::Active : KDecoration2::ColorGroup::Inactive;
     if (type() == KDecoration2::DecorationButtonType::Menu) {
         decoration()->client().data()->icon().paint(painter, geometry().toRect());
     } else {
 
     if (deco) {
         // Fill the button background with an appropriate button image
-        QPixmap btnbg;
+        const Assets &assets = *d->m_assets[decoration()->client().data()->isActive()];
 
     if (b == d->m_leftButtons)
-        btnbg = isPressed() ? *d->leftBtnDownPix[true] : *d->leftBtnUpPix[true];
+        painter->drawImage( geometry().x(), geometry().y(), isPressed() ? assets.leftBtnDown : assets.leftBtnUp );
     else
-        btnbg = isPressed() ? *d->rightBtnDownPix[true] : *d->rightBtnUpPix[true];
-
-        painter->drawPixmap( geometry().x(), geometry().y(), btnbg );
+        painter->drawImage( geometry().x(), geometry().y(), isPressed() ? assets.rightBtnDown : assets.rightBtnUp );
 
         // Select the appropriate button decoration color
-        bool darkDeco = qGray( decoration()->client().data()->color(
-                colorGroup,
-                b == d->m_leftButtons ? KDecoration2::ColorRole::TitleBar : KDecoration2::ColorRole::Frame).rgb() ) > 127;
+        const FrameColors &colors = d->m_colors[decoration()->client().data()->isActive()];
+        bool darkDeco = qGray( (b == d->m_leftButtons ? colors.titleBar : colors.frame).rgb() ) > 127;
 
-        painter->setPen(Qt::NoPen);
-        if (m_hoverProgress)
-            painter->setBrush( darkDeco ? Qt::darkGray : Qt::lightGray );
+        QColor color;
+        if (isHovered())
+            color = darkDeco ? Qt::darkGray : Qt::lightGray;
         else
-            painter->setBrush( darkDeco ? Qt::black : Qt::white );
+            color = darkDeco ? Qt::black : Qt::white;
 
-        QPoint offset(geometry().x()+(geometry().width()-10)/2, geometry().y()+(geometry().height()-10)/2);
+        QPoint offset = glyphRect().topLeft();
         if (isPressed())
             offset += QPoint(1,1);
+        // glyphs stay vector paths, so they are sharp on scaled outputs
+        painter->save();
         painter->translate(offset);
-        painter->drawPath(*deco);
-        painter->translate(-offset);
+        painter->setPen(Qt::NoPen);
+        painter->setBrush(color);
+        painter->drawPath(glyphPath(deco));
+        painter->restore();
     } else if (type() == KDecoration2::DecorationButtonType::OnAllDesktops) {
-        QPixmap btnpix;
-
-        btnpix = isChecked() ? *d->pinDownPix : *d->pinUpPix;
+        const Assets &assets = *d->m_assets[decoration()->client().data()->isActive()];
 
-        painter->drawPixmap(geometry().x()+geometry().width()/2-8, geometry().y()+geometry().height()/2-8, btnpix);
+        painter->drawImage(geometry().x()+geometry().width()/2-8, geometry().y()+geometry().height()/2-8, isChecked() ? assets.pinDown : assets.pinUp);
     }
 
     }
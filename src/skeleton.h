@@ -30,16 +30,88 @@
 #include <KDecoration2/Decoration>
 #include <KDecoration2/DecorationButton>
 
+#include <QAtomicInt>
+#include <QColor>
+#include <QFutureWatcher>
+#include <QImage>
+#include <QMargins>
 #include <QPointer>
+#include <QRegion>
+#include <QSharedPointer>
 #include <QVariantList>
 #include <QVariantMap>
 
 namespace KDecoration2 { class DecorationButtonGroup; }
-class QPropertyAnimation;
 
 namespace Skeleton
 {
 
+class DecorationButton;
+
+// what caused a repaint, tracked for the KDE2_PAINT_STATS diagnostics
+enum RepaintTrigger {
+    OtherRepaint,
+    HoverRepaint,
+    CaptionRepaint,
+    ActivationRepaint,
+    ResizeRepaint,
+    PaletteRepaint,
+    MixedRepaint,
+    RepaintTriggerCount
+};
+
+// Blocks until no asset set is being rendered anymore
+void waitForAssets();
+
+#ifdef KDE2_COUNT_INSTANCES
+// live instances, only counted in the stress test build
+extern QAtomicInt liveAssets;
+extern QAtomicInt liveButtons;
+#endif
+
+// Pre-rendered button backgrounds, pins and stipple for one set of colors
+struct Assets
+{
+#ifdef KDE2_COUNT_INSTANCES
+    Assets() { liveAssets.ref(); }
+    ~Assets() { liveAssets.deref(); }
+#endif
+
+    QImage leftBtnUp;
+    QImage leftBtnDown;
+    QImage rightBtnUp;
+    QImage rightBtnDown;
+    QImage pinUp;
+    QImage pinDown;
+    QImage title;
+};
+
+typedef QSharedPointer<const Assets> AssetsPtr;
+
+// Client colors of one color group. Painting uses the colors the current
+// assets were rendered with, so a palette change switches the frame and the
+// buttons at the same time.
+struct FrameColors
+{
+    QColor titleBar;
+    QColor frame;
+    QColor foreground;
+    // titlebar fill of inactive windows
+    QColor window;
+};
+
+// The elided caption painted in the foreground color of one color group,
+// only as wide as the text
+struct CaptionLayer
+{
+    QImage image;
+    QString caption;
+    QString text;
+    QRgb color;
+    QSize size;
+    int width;
+};
+
 class Decoration : public KDecoration2::Decoration
 {
     Q_OBJECT
@@ -51,40 +123,54 @@ public:
 public:
     void init() Q_DECL_OVERRIDE;
     void paint(QPainter *painter, const QRect &repaintArea) Q_DECL_OVERRIDE;
-    void updateHoverAnimation(qreal hoverProgress, const QRect &updateRect);
+    void countRepaint(RepaintTrigger trigger, const QRect &rect);
 
 private:
-    void createButtons();
-    void deleteButtons();
+    bool syncButtons(KDecoration2::DecorationButtonGroup *group, const QVector<KDecoration2::DecorationButtonType> &types);
+    void updateButton(DecorationButton *button);
     void createShadow();
+    void requestRepaint(RepaintTrigger trigger, const QRegion &region = QRegion());
+    QRegion frameRegion() const;
+    QRect captionDamage() const;
+    void loadAssets(bool async);
+    void paintFrame(QPainter *painter, const QRect &clip, QVector<QRect> *touched);
+    void updateCaptionLayer(const QColor &color, qreal devicePixelRatio);
+    void invalidateLayers();
 
 private Q_SLOTS:
     void recreateButtons();
     void updateButtons();
+    void updateShade();
     void updateLayout();
 
 private:
     QRect m_frameRect;
     QRect m_captionRect;
+    // borders of the unshaded window
+    QMargins m_borders;
+    int m_titleHeight;
+    // cached titlebar layers of the current state only, see paint()
+    QImage m_titleLayer;
+    int m_titleLayerState;
+    CaptionLayer m_captionLayer;
+    // damage not painted yet per trigger, only kept with KDE2_PAINT_STATS
+    QRegion m_pendingDamage[RepaintTriggerCount];
+    QFutureWatcher<AssetsPtr> *m_assetsWatcher[2];
+    bool m_assetsPending[2];
+    FrameColors m_pendingColors[2];
 public:
     KDecoration2::DecorationButtonGroup *m_leftButtons;
     KDecoration2::DecorationButtonGroup *m_rightButtons;
 
-    void createPixmaps();
     int buttonSize;
-    QPixmap* pinDownPix;
-    QPixmap* pinUpPix;
-    QPixmap* titlePix;
-    QPixmap* rightBtnUpPix[2];
-    QPixmap* rightBtnDownPix[2];
-    QPixmap* leftBtnUpPix[2];
-    QPixmap* leftBtnDownPix[2];
+    // indexed by the active state of the client
+    AssetsPtr m_assets[2];
+    FrameColors m_colors[2];
 };
 
 class DecorationButton : public KDecoration2::DecorationButton
 {
     Q_OBJECT
-    Q_PROPERTY(qreal hoverProgress READ hoverProgress WRITE setHoverProgress)
 
 public:
     DecorationButton(KDecoration2::DecorationButtonType type, Decoration *decoration, QObject *parent = Q_NULLPTR);
@@ -93,20 +179,12 @@ public:
 public:
     void paint(QPainter *painter, const QRect &repaintArea) Q_DECL_OVERRIDE;
 
-public:
-    qreal hoverProgress() const;
-    void setHoverProgress(qreal hoverProgress);
-
-private:
-    void startHoverAnimation(qreal endValue);
-
 private:
-    QPointer<QPropertyAnimation> m_hoverAnimation;
-    qreal m_hoverProgress;
+    QRect glyphRect() const;
 
 public:
     void setBitmap(const unsigned char *bitmap);
-    QPainterPath* deco;
+    const unsigned char *deco;
     Decoration *d;
     KDecoration2::DecorationButtonGroup *b;
 };
@@ -0,0 +1,248 @@
+/*
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef KDE2_WORKLOAD_BRIDGE_H
+#define KDE2_WORKLOAD_BRIDGE_H
+
+// Stand-ins for the parts of KWin a decoration talks to, shared by the
+// headless workload and stress tools. They keep the client state in plain
+// members and emit the client and settings signals when it changes.
+
+#include <KDecoration2/DecoratedClient>
+#include <KDecoration2/DecorationSettings>
+#include <KDecoration2/Private/DecoratedClientPrivate>
+#include <KDecoration2/Private/DecorationBridge>
+#include <KDecoration2/Private/DecorationSettingsPrivate>
+
+#include <QIcon>
+#include <QPalette>
+
+#include <memory>
+
+// The set of pure virtuals differs between KDecoration2 versions, so the
+// stand-ins implement the union of them without marking overrides.
+
+class WorkloadClient : public KDecoration2::DecoratedClientPrivate
+{
+public:
+    WorkloadClient(KDecoration2::DecoratedClient *client, KDecoration2::Decoration *decoration)
+        : KDecoration2::DecoratedClientPrivate(client, decoration)
+        , m_active(true)
+        , m_maximized(false)
+        , m_shaded(false)
+        , m_palette(0)
+        , m_width(800)
+        , m_height(600)
+        , m_caption(QStringLiteral("Konsole - ~/src/kdecoration2-kde2"))
+    {
+    }
+
+    bool isActive() const { return m_active; }
+    QString caption() const { return m_caption; }
+    int desktop() const { return 1; }
+    bool isOnAllDesktops() const { return false; }
+    bool isShaded() const { return m_shaded; }
+    QIcon icon() const { return QIcon(); }
+    bool isMaximized() const { return m_maximized; }
+    bool isMaximizedHorizontally() const { return m_maximized; }
+    bool isMaximizedVertically() const { return m_maximized; }
+    bool isKeepAbove() const { return false; }
+    bool isKeepBelow() const { return false; }
+    bool isCloseable() const { return true; }
+    bool isMaximizeable() const { return true; }
+    bool isMinimizeable() const { return true; }
+    bool providesContextHelp() const { return true; }
+    bool isModal() const { return false; }
+    bool isShadeable() const { return true; }
+    bool isMoveable() const { return true; }
+    bool isResizeable() const { return true; }
+    WId windowId() const { return 0; }
+    WId decorationId() const { return 0; }
+    int width() const { return m_width; }
+    int height() const { return m_height; }
+    QSize size() const { return QSize(m_width, m_height); }
+    QPalette palette() const { return QPalette(); }
+    Qt::Edges adjacentScreenEdges() const { return Qt::Edges(); }
+    bool hasApplicationMenu() const { return false; }
+    bool isApplicationMenuActive() const { return false; }
+
+    // palette variants differ in the titlebar hue
+    QColor color(KDecoration2::ColorGroup group, KDecoration2::ColorRole role) const
+    {
+        const bool active = group == KDecoration2::ColorGroup::Active;
+        switch (role) {
+        case KDecoration2::ColorRole::TitleBar:
+            return active ? QColor::fromHsv((216 + 40 * m_palette) % 360, 255, 143) : QColor(0x6e, 0x6e, 0x6e);
+        case KDecoration2::ColorRole::Foreground:
+            return active ? Qt::white : QColor(0xc0, 0xc0, 0xc0);
+        case KDecoration2::ColorRole::Frame:
+        default:
+            return QColor(0xc0, 0xc0, 0xc0);
+        }
+    }
+
+    void requestShowToolTip(const QString &) {}
+    void requestHideToolTip() {}
+    void requestClose() {}
+    void requestToggleMaximization(Qt::MouseButtons) {}
+    void requestMinimize() {}
+    void requestContextHelp() {}
+    void requestToggleOnAllDesktops() {}
+    void requestToggleShade() {}
+    void requestToggleKeepAbove() {}
+    void requestToggleKeepBelow() {}
+    void requestShowWindowMenu() {}
+    void requestShowWindowMenu(const QRect &) {}
+    void requestShowApplicationMenu(const QRect &, int) {}
+    void showApplicationMenu(int) {}
+
+    void setActive(bool active)
+    {
+        m_active = active;
+        emit client()->activeChanged(active);
+    }
+
+    void setCaption(const QString &caption)
+    {
+        m_caption = caption;
+        emit client()->captionChanged(caption);
+    }
+
+    void resize(int width, int height)
+    {
+        m_width = width;
+        m_height = height;
+        emit client()->widthChanged(width);
+        emit client()->heightChanged(height);
+    }
+
+    void setMaximized(bool maximized)
+    {
+        m_maximized = maximized;
+        emit client()->maximizedHorizontallyChanged(maximized);
+        emit client()->maximizedVerticallyChanged(maximized);
+        emit client()->maximizedChanged(maximized);
+    }
+
+    void setShaded(bool shaded)
+    {
+        m_shaded = shaded;
+        emit client()->shadedChanged(shaded);
+    }
+
+    void setPalette(int palette)
+    {
+        m_palette = palette;
+        emit client()->paletteChanged(QPalette());
+    }
+
+private:
+    bool m_active;
+    bool m_maximized;
+    bool m_shaded;
+    int m_palette;
+    int m_width;
+    int m_height;
+    QString m_caption;
+};
+
+class WorkloadSettings : public KDecoration2::DecorationSettingsPrivate
+{
+public:
+    explicit WorkloadSettings(KDecoration2::DecorationSettings *parent)
+        : KDecoration2::DecorationSettingsPrivate(parent)
+        , m_layout(0)
+    {
+    }
+
+    bool isAlphaChannelSupported() const { return true; }
+    bool isOnAllDesktopsAvailable() const { return true; }
+    bool isCloseOnDoubleClickOnMenu() const { return false; }
+    KDecoration2::BorderSize borderSize() const { return KDecoration2::BorderSize::Normal; }
+
+    // layout 0 is the KDE 2 default, the others move and drop buttons
+    QVector<KDecoration2::DecorationButtonType> decorationButtonsLeft() const
+    {
+        QVector<KDecoration2::DecorationButtonType> buttons;
+        buttons << KDecoration2::DecorationButtonType::Menu;
+        if (m_layout != 2)
+            buttons << KDecoration2::DecorationButtonType::OnAllDesktops;
+        if (m_layout == 1)
+            buttons << KDecoration2::DecorationButtonType::Shade;
+        return buttons;
+    }
+
+    QVector<KDecoration2::DecorationButtonType> decorationButtonsRight() const
+    {
+        QVector<KDecoration2::DecorationButtonType> buttons;
+        if (m_layout != 1)
+            buttons << KDecoration2::DecorationButtonType::ContextHelp;
+        if (m_layout == 2)
+            buttons << KDecoration2::DecorationButtonType::KeepAbove << KDecoration2::DecorationButtonType::KeepBelow;
+        buttons << KDecoration2::DecorationButtonType::Minimize
+                << KDecoration2::DecorationButtonType::Maximize
+                << KDecoration2::DecorationButtonType::Close;
+        return buttons;
+    }
+
+    void setLayout(int layout)
+    {
+        m_layout = layout;
+        emit decorationSettings()->decorationButtonsLeftChanged(decorationButtonsLeft());
+        emit decorationSettings()->decorationButtonsRightChanged(decorationButtonsRight());
+    }
+
+private:
+    int m_layout;
+};
+
+class WorkloadBridge : public KDecoration2::DecorationBridge
+{
+public:
+    WorkloadBridge()
+        : m_client(Q_NULLPTR)
+        , m_settings(Q_NULLPTR)
+    {
+    }
+
+    std::unique_ptr<KDecoration2::DecoratedClientPrivate> createClient(KDecoration2::DecoratedClient *client, KDecoration2::Decoration *decoration)
+    {
+        m_client = new WorkloadClient(client, decoration);
+        return std::unique_ptr<KDecoration2::DecoratedClientPrivate>(m_client);
+    }
+
+    std::unique_ptr<KDecoration2::DecorationSettingsPrivate> settings(KDecoration2::DecorationSettings *parent)
+    {
+        m_settings = new WorkloadSettings(parent);
+        return std::unique_ptr<KDecoration2::DecorationSettingsPrivate>(m_settings);
+    }
+
+    // only called by old KDecoration2 versions, newer ones emit damaged()
+    void update(KDecoration2::Decoration *, const QRect &) {}
+
+    WorkloadClient *m_client;
+    WorkloadSettings *m_settings;
+};
+
+#endif
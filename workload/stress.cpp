@@ -0,0 +1,244 @@
+/*
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+// Headless stress test for long-running sessions. It drives a decoration
+// through random activation, maximize, shade, resize, palette, caption and
+// button layout changes, painting after each one. After a warm-up it samples
+// the heap in use and the resident set size, and fails when either grows
+// with the number of transitions, or when there are more live buttons or
+// asset sets than the warm-up reached. The decoration is compiled in with
+// KDE2_COUNT_INSTANCES, so the live instances can be counted.
+
+#include "bridge.h"
+#include "skeleton.h"
+
+#include <QApplication>
+#include <QFile>
+#include <QImage>
+#include <QPainter>
+#include <QPair>
+#include <QVector>
+
+#include <cstdio>
+#include <random>
+
+#include <malloc.h>
+#include <unistd.h>
+
+struct Sample
+{
+    qint64 heap;
+    qint64 rss;
+    int buttons;
+    int assets;
+};
+
+// Bytes handed out by malloc and not freed yet, -1 where unknown
+static qint64 heapBytes()
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    return qint64(mallinfo2().uordblks);
+#elif defined(__GLIBC__)
+    return qint64(uint(mallinfo().uordblks));
+#else
+    return -1;
+#endif
+}
+
+// Least squares slope of the samples in bytes per transition
+static double growth(const QVector<QPair<int, qint64>> &samples)
+{
+    if (samples.size() < 3)
+        return 0;
+    double meanX = 0;
+    double meanY = 0;
+    for (int i = 0; i < samples.size(); ++i) {
+        meanX += samples.at(i).first;
+        meanY += samples.at(i).second;
+    }
+    meanX /= samples.size();
+    meanY /= samples.size();
+    double covariance = 0;
+    double variance = 0;
+    for (int i = 0; i < samples.size(); ++i) {
+        const double dx = samples.at(i).first - meanX;
+        covariance += dx * (samples.at(i).second - meanY);
+        variance += dx * dx;
+    }
+    return variance > 0 ? covariance / variance : 0;
+}
+
+static qint64 residentBytes()
+{
+    QFile file(QStringLiteral("/proc/self/statm"));
+    if (!file.open(QIODevice::ReadOnly)) {
+        return -1;
+    }
+    const QList<QByteArray> fields = file.readAll().split(' ');
+    if (fields.size() < 2) {
+        return -1;
+    }
+    return fields.at(1).toLongLong() * sysconf(_SC_PAGESIZE);
+}
+
+// Lets asset renders finish and their results be delivered, so that only
+// sets still referenced are counted
+static Sample settle()
+{
+    Skeleton::waitForAssets();
+    QCoreApplication::processEvents();
+    QCoreApplication::processEvents();
+
+    Sample sample;
+    sample.heap = heapBytes();
+    sample.rss = residentBytes();
+    sample.buttons = Skeleton::liveButtons.load();
+    sample.assets = Skeleton::liveAssets.load();
+    return sample;
+}
+
+int main(int argc, char **argv)
+{
+    QApplication app(argc, argv);
+
+    // "--long" runs millions of transitions, meant for a soak run before a
+    // release rather than for every build
+    QStringList args = app.arguments();
+    const bool longRun = args.removeAll(QStringLiteral("--long")) > 0;
+    const int iterations = args.size() > 1 ? qMax(1, args.at(1).toInt()) : longRun ? 5000000 : 200000;
+    const uint seed = args.size() > 2 ? args.at(2).toUInt() : 1;
+    // Caches and layers make single samples noisy, so growth is judged by
+    // the trend after the warm-up, in bytes per transition. Resident memory
+    // gets more leeway, the allocator does not hand every freed page back.
+    const double maxHeapGrowth = 1.0;
+    const double maxRssGrowth = 8.0;
+    const int layouts = 3;
+    const int palettes = 4;
+
+    WorkloadBridge bridge;
+    QVariantMap map;
+    map.insert(QStringLiteral("bridge"), QVariant::fromValue(static_cast<KDecoration2::DecorationBridge *>(&bridge)));
+    Skeleton::Decoration *decoration = new Skeleton::Decoration(Q_NULLPTR, QVariantList() << map);
+    QSharedPointer<KDecoration2::DecorationSettings> settings(new KDecoration2::DecorationSettings(&bridge));
+    decoration->setSettings(settings);
+    decoration->init();
+    WorkloadClient *client = bridge.m_client;
+    WorkloadSettings *clientSettings = bridge.m_settings;
+
+    QImage image;
+    auto paint = [&]() {
+        if (decoration->rect().isEmpty())
+            return;
+        if (image.size() != decoration->rect().size())
+            image = QImage(decoration->rect().size(), QImage::Format_ARGB32_Premultiplied);
+        QPainter painter(&image);
+        decoration->paint(&painter, decoration->rect());
+    };
+
+    // every button layout and palette is seen during the warm-up, so the
+    // limits cover the largest legitimate state
+    for (int layout = 0; layout < layouts; ++layout) {
+        clientSettings->setLayout(layout);
+        for (int palette = 0; palette < palettes; ++palette) {
+            client->setPalette(palette);
+            QCoreApplication::processEvents();
+            paint();
+        }
+    }
+
+    std::mt19937 random(seed);
+    const int warmup = iterations / 5;
+    const int sampleInterval = qMax(1, iterations / 500);
+    Sample limit = settle();
+    Sample sample = limit;
+    QVector<QPair<int, qint64>> heapSamples;
+    QVector<QPair<int, qint64>> rssSamples;
+    int failedAt = -1;
+
+    for (int i = 0; i < iterations; ++i) {
+        switch (random() % 7) {
+        case 0:
+            client->setActive(!client->isActive());
+            break;
+        case 1:
+            client->setMaximized(!client->isMaximized());
+            break;
+        case 2:
+            client->setShaded(!client->isShaded());
+            break;
+        case 3:
+            client->resize(200 + random() % 1400, 100 + random() % 1000);
+            break;
+        case 4:
+            client->setPalette(random() % palettes);
+            break;
+        case 5:
+            client->setCaption(QStringLiteral("Konsole - ~/src/kdecoration2-kde2 - %1").arg(random() % 1000));
+            break;
+        case 6:
+            clientSettings->setLayout(random() % layouts);
+            break;
+        }
+        QCoreApplication::processEvents();
+        paint();
+
+        if (i % sampleInterval != 0 && i != iterations - 1)
+            continue;
+        sample = settle();
+        if (i < warmup) {
+            limit.buttons = qMax(limit.buttons, sample.buttons);
+            limit.assets = qMax(limit.assets, sample.assets);
+            continue;
+        }
+        if (sample.buttons > limit.buttons || sample.assets > limit.assets) {
+            failedAt = i;
+            break;
+        }
+        if (sample.heap >= 0)
+            heapSamples.append(qMakePair(i, sample.heap));
+        if (sample.rss >= 0)
+            rssSamples.append(qMakePair(i, sample.rss));
+    }
+
+    const double heapGrowth = growth(heapSamples);
+    const double rssGrowth = growth(rssSamples);
+
+    printf("kde2 decoration stress, %d iterations, seed %u\n", iterations, seed);
+    printf("  heap        %8lld kB, %+.2f bytes per transition (limit %+.2f)\n", sample.heap / 1024, heapGrowth, maxHeapGrowth);
+    printf("  rss         %8lld kB, %+.2f bytes per transition (limit %+.2f)\n", sample.rss / 1024, rssGrowth, maxRssGrowth);
+    printf("  buttons     %8d    (limit %d)\n", sample.buttons, limit.buttons);
+    printf("  asset sets  %8d    (limit %d)\n", sample.assets, limit.assets);
+
+    delete decoration;
+
+    if (failedAt >= 0) {
+        fprintf(stderr, "live instances grew after the warm-up, at iteration %d\n", failedAt);
+        return 1;
+    }
+    if (heapGrowth > maxHeapGrowth || rssGrowth > maxRssGrowth) {
+        fprintf(stderr, "memory grows with the number of transitions\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,187 @@
+/*
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+// Headless paint, resize and activation workload for the decoration plugin.
+// It loads the plugin like KWin does, but through a stand-in bridge, so it
+// runs without a compositor (QT_QPA_PLATFORM=offscreen). It is the training
+// run of the PGO build and prints the time per operation. Given the plugin of
+// another build as a baseline, it runs the same workload against that one too
+// and prints the speedup per operation.
+
+#include "bridge.h"
+
+#include <KDecoration2/Decoration>
+#include <KDecoration2/DecorationButton>
+
+#include <KPluginFactory>
+#include <KPluginLoader>
+
+#include <QApplication>
+#include <QElapsedTimer>
+#include <QHoverEvent>
+#include <QImage>
+#include <QPainter>
+#include <QVector>
+
+#include <cstdio>
+
+struct Result
+{
+    const char *name;
+    double usPerOp;
+};
+
+template<typename Operation>
+static void measure(QVector<Result> *results, const char *name, int iterations, Operation operation)
+{
+    // warm up caches and lazily built layers first
+    operation(0);
+
+    QElapsedTimer timer;
+    timer.start();
+    for (int i = 0; i < iterations; ++i)
+        operation(i);
+    Result result;
+    result.name = name;
+    result.usPerOp = timer.nsecsElapsed() / 1000.0 / iterations;
+    results->append(result);
+}
+
+static bool runWorkload(const QString &plugin, int iterations, QVector<Result> *results)
+{
+    KPluginLoader loader(plugin);
+    KPluginFactory *factory = loader.factory();
+    if (!factory) {
+        qWarning("cannot load %s: %s", qPrintable(plugin), qPrintable(loader.errorString()));
+        return false;
+    }
+
+    WorkloadBridge bridge;
+    QVariantMap map;
+    map.insert(QStringLiteral("bridge"), QVariant::fromValue(static_cast<KDecoration2::DecorationBridge *>(&bridge)));
+    KDecoration2::Decoration *decoration = factory->create<KDecoration2::Decoration>(Q_NULLPTR, QVariantList() << map);
+    if (!decoration || !bridge.m_client) {
+        qWarning("cannot create a decoration from %s", qPrintable(plugin));
+        return false;
+    }
+    QSharedPointer<KDecoration2::DecorationSettings> settings(new KDecoration2::DecorationSettings(&bridge));
+    decoration->setSettings(settings);
+    decoration->init();
+    WorkloadClient *client = bridge.m_client;
+
+    QImage image;
+    QRegion damage;
+    QObject::connect(decoration, &KDecoration2::Decoration::damaged, [&damage](const QRegion &region) { damage += region; });
+
+    // paint like the compositor does, the damage collected since the last paint
+    auto paint = [&](const QRect &rect) {
+        if (image.size() != decoration->rect().size())
+            image = QImage(decoration->rect().size(), QImage::Format_ARGB32_Premultiplied);
+        QPainter painter(&image);
+        painter.setClipRect(rect);
+        decoration->paint(&painter, rect);
+    };
+    auto paintDamage = [&]() {
+        if (!damage.isEmpty())
+            paint(damage.boundingRect());
+        damage = QRegion();
+    };
+
+    KDecoration2::DecorationButton *closeButton = Q_NULLPTR;
+    const QList<KDecoration2::DecorationButton *> buttons = decoration->findChildren<KDecoration2::DecorationButton *>();
+    for (int i = 0; i < buttons.size(); ++i) {
+        if (buttons.at(i)->type() == KDecoration2::DecorationButtonType::Close)
+            closeButton = buttons.at(i);
+    }
+
+    measure(results, "paint", iterations, [&](int) {
+        paint(decoration->rect());
+    });
+
+    measure(results, "resize", iterations, [&](int i) {
+        client->resize(800 + i % 64, 600 + i % 48);
+        paint(decoration->rect());
+    });
+    client->resize(800, 600);
+    damage = QRegion();
+
+    measure(results, "activation", iterations, [&](int i) {
+        client->setActive(i % 2);
+        paintDamage();
+    });
+    client->setActive(true);
+    paintDamage();
+
+    measure(results, "caption", iterations, [&](int i) {
+        client->setCaption(QStringLiteral("Konsole - ~/src/kdecoration2-kde2 - %1").arg(i % 100));
+        paintDamage();
+    });
+
+    if (closeButton) {
+        const QPointF inside = closeButton->geometry().center();
+        const QPointF outside(decoration->rect().width() / 2, 4);
+        measure(results, "hover", iterations, [&](int i) {
+            QHoverEvent event(QEvent::HoverMove, i % 2 ? outside : inside, i % 2 ? inside : outside);
+            QCoreApplication::sendEvent(decoration, &event);
+            QCoreApplication::processEvents();
+            paintDamage();
+        });
+    }
+
+    delete decoration;
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    QApplication app(argc, argv);
+
+    const QStringList args = app.arguments();
+    if (args.size() < 2) {
+        qWarning("usage: %s <kde2_decoration plugin> [iterations] [baseline plugin]", argv[0]);
+        return 1;
+    }
+    const int iterations = args.size() > 2 ? qMax(1, args.at(2).toInt()) : 2000;
+    const QString baselinePlugin = args.size() > 3 ? args.at(3) : QString();
+
+    QVector<Result> results;
+    if (!runWorkload(args.at(1), iterations, &results))
+        return 1;
+    QVector<Result> baseline;
+    if (!baselinePlugin.isEmpty() && !runWorkload(baselinePlugin, iterations, &baseline))
+        return 1;
+
+    printf("kde2 decoration workload, %d iterations\n", iterations);
+    if (baseline.isEmpty()) {
+        for (int i = 0; i < results.size(); ++i)
+            printf("%-12s %10.2f us/op\n", results.at(i).name, results.at(i).usPerOp);
+        return 0;
+    }
+    printf("%-12s %10s %10s %8s\n", "", "us/op", "baseline", "speedup");
+    for (int i = 0; i < results.size() && i < baseline.size(); ++i) {
+        printf("%-12s %10.2f %10.2f %7.2fx\n", results.at(i).name, results.at(i).usPerOp, baseline.at(i).usPerOp,
+               results.at(i).usPerOp > 0 ? baseline.at(i).usPerOp / results.at(i).usPerOp : 0.0);
+    }
+    return 0;
+}